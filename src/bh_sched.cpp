@@ -0,0 +1,177 @@
+// bh_sched.cpp
+#include "bh_sched.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace {
+
+struct Task {
+    TaskFn fn;
+    void* arg;
+};
+
+// padded so neighbouring workers do not share a cache line
+struct alignas(64) Worker {
+    std::mutex mtx;
+    std::deque<Task> tasks;
+    unsigned rng = 0; // victim selection, only touched by the owner
+};
+
+thread_local Scheduler* tl_sched = nullptr;
+thread_local int tl_id = 0;
+
+} // namespace
+
+struct Scheduler {
+    int n;
+    std::unique_ptr<Worker[]> workers;
+    std::vector<std::thread> threads;
+
+    std::atomic<int> pending{0};    // spawned and not finished yet
+    std::atomic<int> queued{0};     // sitting in some deque
+    std::atomic<int> sleepers{0};
+    std::atomic<bool> stop{false};
+
+    std::mutex sleep_mtx;
+    std::condition_variable wake;
+};
+
+static bool pop_local(Scheduler* s, int id, Task& t) {
+    Worker& w = s->workers[id];
+    std::lock_guard<std::mutex> lk(w.mtx);
+    if (w.tasks.empty()) return false;
+    t = w.tasks.back();
+    w.tasks.pop_back();
+    s->queued.fetch_sub(1);
+    return true;
+}
+
+static bool steal(Scheduler* s, int id, Task& t) {
+    Worker& self = s->workers[id];
+    self.rng ^= self.rng << 13;
+    self.rng ^= self.rng >> 17;
+    self.rng ^= self.rng << 5;
+
+    int start = (int)(self.rng % (unsigned)s->n);
+    for (int k = 0; k < s->n; k++) {
+        int victim = (start + k) % s->n;
+        if (victim == id) continue;
+
+        Worker& w = s->workers[victim];
+        std::lock_guard<std::mutex> lk(w.mtx);
+        if (w.tasks.empty()) continue;
+        t = w.tasks.front();
+        w.tasks.pop_front();
+        s->queued.fetch_sub(1);
+        return true;
+    }
+    return false;
+}
+
+static bool find_task(Scheduler* s, int id, Task& t) {
+    return pop_local(s, id, t) || steal(s, id, t);
+}
+
+static void run(Scheduler* s, const Task& t) {
+    t.fn(t.arg);
+    s->pending.fetch_sub(1, std::memory_order_release);
+}
+
+static void worker_loop(Scheduler* s, int id) {
+    tl_sched = s;
+    tl_id = id;
+
+    while (!s->stop.load()) {
+        Task t;
+        if (find_task(s, id, t)) {
+            run(s, t);
+            continue;
+        }
+
+        // sleepers is raised before queued is checked, sched_spawn does the opposite,
+        // so either the sleeper sees the new task or the spawner sees the sleeper
+        s->sleepers.fetch_add(1);
+        {
+            std::unique_lock<std::mutex> lk(s->sleep_mtx);
+            s->wake.wait(lk, [s] { return s->stop.load() || s->queued.load() > 0; });
+        }
+        s->sleepers.fetch_sub(1);
+    }
+}
+
+extern "C" {
+
+Scheduler* sched_create(int n_threads) {
+    if (n_threads <= 0) {
+        n_threads = (int)std::thread::hardware_concurrency();
+        if (n_threads <= 0) n_threads = 1;
+    }
+
+    Scheduler* s = new Scheduler;
+    s->n = n_threads;
+    s->workers.reset(new Worker[n_threads]);
+    for (int i = 0; i < n_threads; i++) {
+        s->workers[i].rng = 2463534242u + 747796405u * (unsigned)i;
+    }
+
+    tl_sched = s;
+    tl_id = 0;
+    for (int i = 1; i < n_threads; i++) {
+        s->threads.emplace_back(worker_loop, s, i);
+    }
+    return s;
+}
+
+void sched_destroy(Scheduler* sched) {
+    sched->stop.store(true);
+    {
+        std::lock_guard<std::mutex> lk(sched->sleep_mtx);
+    }
+    sched->wake.notify_all();
+    for (std::thread& t : sched->threads) {
+        t.join();
+    }
+    if (tl_sched == sched) tl_sched = nullptr;
+    delete sched;
+}
+
+int sched_threads(const Scheduler* sched) {
+    return sched->n;
+}
+
+void sched_spawn(Scheduler* sched, TaskFn fn, void* arg) {
+    int id = (tl_sched == sched) ? tl_id : 0;
+    Worker& w = sched->workers[id];
+
+    sched->pending.fetch_add(1);
+    {
+        std::lock_guard<std::mutex> lk(w.mtx);
+        w.tasks.push_back(Task{fn, arg});
+        sched->queued.fetch_add(1);
+    }
+
+    if (sched->sleepers.load() > 0) {
+        {
+            std::lock_guard<std::mutex> lk(sched->sleep_mtx);
+        }
+        sched->wake.notify_one();
+    }
+}
+
+void sched_wait(Scheduler* sched) {
+    while (sched->pending.load(std::memory_order_acquire) > 0) {
+        Task t;
+        if (find_task(sched, 0, t)) {
+            run(sched, t);
+        } else {
+            std::this_thread::yield();
+        }
+    }
+}
+
+}
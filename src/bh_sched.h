@@ -0,0 +1,24 @@
+#ifndef BH_SCHED_H
+#define BH_SCHED_H
+
+// work-stealing task scheduler
+// every worker owns a deque, the owner pushes and pops at the back (LIFO, cache warm)
+// and idle workers steal from the front (FIFO, oldest and usually largest tasks)
+// the thread calling sched_create is worker 0, it only runs tasks while inside sched_wait
+
+typedef struct Scheduler Scheduler;
+typedef void (*TaskFn)(void* arg);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+    Scheduler* sched_create(int n_threads);                 // n_threads <= 0 -> one worker per hardware thread
+    void sched_destroy(Scheduler* sched);                   // no tasks may be pending
+    int sched_threads(const Scheduler* sched);
+    void sched_spawn(Scheduler* sched, TaskFn fn, void* arg); // also callable from inside a task
+    void sched_wait(Scheduler* sched);                      // worker 0 only, runs/steals tasks until all spawned ones finished
+#ifdef __cplusplus
+}
+#endif
+
+#endif // BH_SCHED_H
@@ -4,6 +4,21 @@
 #include "math.h"
 #include "time.h"
 #include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+
+// barnes-hut task sizes
+static const int MIN_SUBTREE_BODIES = 256;      // smaller subtrees are not worth a task
+static const int SUBTREES_PER_THREAD = 8;
+static const int MAX_SPLIT_DEPTH = 12;          // top level split gives up on clustered points past this
+static const int FORCE_CHUNKS_PER_THREAD = 16;
+static const int NODE_BLOCK = 256;              // refill size when a subtree outgrows its first claim
+
+struct NodePool {
+    Node* nodes;
+    atomic_int used;
+    int size;
+};
 
 void init_sim(Body* bodies, int* N, int* last_done, Body** simulation_result, int* flag, Node* root, double dt, int alg) {
 
@@ -42,13 +57,20 @@ void simulate(Body* bodies, int* N, double dt, int* last_done, Body** simulation
     
     double elapsed = 0.0;
 
+    Scheduler* sched = NULL;
+    int* cost = NULL;
+    if(alg==1) {
+        sched = sched_create(0);
+        cost = (int*)calloc(*N, sizeof(int)); // no measurement before the first step, all bodies weigh the same
+    }
+
     while(*flag)
     {
         
         if(alg==0) {
             brute_force_update(bodies, N, dt);
         } else if(alg==1) {
-            barnes_hut_update(bodies, root, N, dt);
+            barnes_hut_update(bodies, root, N, dt, sched, cost);
         }
 
         // saving timestep to render
@@ -59,6 +81,11 @@ void simulate(Body* bodies, int* N, double dt, int* last_done, Body** simulation
             elapsed = 0.0;
         }
     }
+
+    if(sched) {
+        sched_destroy(sched);
+        free(cost);
+    }
 }
 
 // Integrator schemes for brute force update
@@ -108,19 +135,106 @@ void brute_force_update(Body* bodies, int* N, double dt) {
     }
 };
 
+typedef struct {
+    Node* root;
+    Body** bodies;
+    int count;
+    Body* first; // cost index of a body is its offset from first
+    int* cost;
+    double dt;
+} ForceChunk;
+
+// positions are written in place, walks of other chunks only read the center of mass copies in the tree
+static void force_chunk(void* arg) {
+    ForceChunk* chunk = (ForceChunk*)arg;
+    for(int i=0;i<chunk->count;i++) {
+        Body* body = chunk->bodies[i];
+        Vec2 acc = (Vec2){0.0,0.0};
+        chunk->cost[body-chunk->first] = force_calc(chunk->root, body, &acc);
+        symplectic_euler(body, &acc, chunk->dt);
+    }
+}
+
 // O(nlogn) barnes_hut optimization
-void barnes_hut_update(Body* bodies, Node* root, int* N, double dt) {
-    Quadtree qt;
-    construct_tree(bodies, root, N, &qt);
-    update_masses(&qt.nodes[0]);
+void barnes_hut_update(Body* bodies, Node* root, int* N, double dt, Scheduler* sched, int* cost) {
+    TopTree tt;
+    construct_tree(bodies, root, N, &tt, sched);
+    update_tree_masses(&tt, sched);
+
+    // walk lengths differ by orders of magnitude between the dense center and the edge,
+    // so chunks are cut to equal cost as measured in the previous step, in tree order for locality
+    long long total = 0;
     for(int i=0;i<(*N);i++) {
-        Vec2 acc = (Vec2){0.0,0.0};
-        force_calc(&qt.nodes[0], &bodies[i], &acc);
-        //printf("%f\n", dt);
-        symplectic_euler(&bodies[i], &acc, dt);
+        total += MAX(cost[i], 1);
     }
+    int max_chunks = sched_threads(sched)*FORCE_CHUNKS_PER_THREAD;
+    long long target = total/max_chunks+1;
+
+    ForceChunk* chunks = (ForceChunk*)malloc(sizeof(ForceChunk)*max_chunks);
+    int n_chunks = 0;
+    int begin = 0;
+    long long acc_cost = 0;
+    for(int k=0;k<(*N);k++) {
+        acc_cost += MAX(cost[tt.order[k]-bodies], 1);
+        if(acc_cost>=target || k==(*N)-1) {
+            chunks[n_chunks] = (ForceChunk){root, &tt.order[begin], k+1-begin, bodies, cost, dt};
+            n_chunks++;
+            begin = k+1;
+            acc_cost = 0;
+        }
+    }
+
+    for(int i=0;i<n_chunks;i++) {
+        sched_spawn(sched, force_chunk, &chunks[i]);
+    }
+    sched_wait(sched);
+
+    free(chunks);
+    free_tree(&tt);
+}
 
-    free(qt.nodes);
+static int quadrant_of(const Node* node, const Vec2* pos) {
+    // (n, w)
+    // (0 0) = 0 north east
+    // (0 1) = 1 north west
+    // (1 0) = 2 south east
+    // (1 1) = 3 south west
+    return 2*(pos->y > node->center.y ? 0 : 1)+(pos->x > node->center.x ? 1 : 0);
+}
+
+// hand qt a fresh block of n nodes from its pool
+static int claim_nodes(Quadtree* qt, int n) {
+    if (qt->pool == NULL) return 0;
+    int first = atomic_fetch_add(&qt->pool->used, n);
+    if (first+n > qt->pool->size) return 0;
+    qt->nodes = qt->pool->nodes+first;
+    qt->index = 0;
+    qt->size = n;
+    return 1;
+}
+
+// initialize the four children of an external node
+static void subdivide(Node* root, Quadtree* qt) {
+    if (qt->index+4 > qt->size && !claim_nodes(qt, NODE_BLOCK)) {
+        fprintf(stderr, "Quadtree overflow\n");
+        exit(1);
+    }
+
+    for(int i=0;i<4;i++) {
+        Node buf;
+        buf.obj = NULL;
+        for(int i=0;i<4;i++) {
+            buf.children[i] = NULL;
+        }
+        buf.center = (Vec2){root->center.x+((((i&1)==0)?-1:1)*(root->r/2)),root->center.y+(((i>>1)==0?1:-1)*(root->r/2))};
+        buf.center_of_mass = (Vec2){0.0,0.0};
+        buf.r = root->r/2;
+        buf.mass = 0.0;
+
+        qt->nodes[qt->index] = buf;
+        root->children[i] = &(qt->nodes[qt->index]);
+        (qt->index)++;
+    }
 }
 
 void insert_body(Body* body, Node* root, Quadtree* qt) {
@@ -132,56 +246,73 @@ void insert_body(Body* body, Node* root, Quadtree* qt) {
 
         // recursively insert the body b in the appropriate quadrant
         // 2.1. appropriate quadrant
-        // (n, w)
-        // (0 0) = 0 north east
-        // (0 1) = 1 north west
-        // (1 0) = 2 south east
-        // (1 1) = 3 south west
-
-        int quadrant = 2*(body->pos.y > root->center.y ? 0 : 1)+(body->pos.x > root->center.x ? 1 : 0);
+        int quadrant = quadrant_of(root, &body->pos);
         insert_body(body, root->children[quadrant], qt);
     }
     else { // at this point the node is guaranteed to be external (leaf)
         // subdivide quadrant -> initialize children
         // recursively insert b and c into appropriate quadrant(s).
         
-        int quadrant_b = 2*(root->obj->pos.y > root->center.y ? 0 : 1)+(root->obj->pos.x > root->center.x ? 1 : 0);
-        int quadrant_c = 2*(body->pos.y > root->center.y ? 0 : 1)+(body->pos.x > root->center.x ? 1 : 0);
+        int quadrant_b = quadrant_of(root, &root->obj->pos);
+        int quadrant_c = quadrant_of(root, &body->pos);
 
         Body* obj_buffer = root->obj;
         root->obj = NULL;
 
-        for(int i=0;i<4;i++) {
-            Node buf;
-            buf.obj = NULL;
-            for(int i=0;i<4;i++) {
-                buf.children[i] = NULL;
-            }
-            buf.center = (Vec2){root->center.x+((((i&1)==0)?-1:1)*(root->r/2)),root->center.y+(((i>>1)==0?1:-1)*(root->r/2))};
-            buf.center_of_mass = (Vec2){0.0,0.0};
-            buf.r = root->r/2;
-            buf.mass = 0.0;
-
-            if (qt->index >= qt->size) {
-                fprintf(stderr, "Quadtree overflow\n");
-                exit(1);
-            }
-            qt->nodes[qt->index] = buf;
-            root->children[i] = &(qt->nodes[qt->index]);
-            (qt->index)++;
-        }
+        subdivide(root, qt);
 
         insert_body(obj_buffer, root->children[quadrant_b], qt);
         insert_body(body, root->children[quadrant_c], qt);
     }
 }
 
+// split node until its bodies fit one task, bodies are reordered so every subtree owns a contiguous run
+static void split_top(Node* node, Body** bodies, int count, int depth, int cutoff, Body** scratch, TopTree* tt) {
+    if(count<=cutoff || depth>=MAX_SPLIT_DEPTH || tt->qt.index+4>tt->qt.size) {
+        Subtree* st = &tt->subtrees[tt->n_subtrees++];
+        st->root = node;
+        st->bodies = bodies;
+        st->count = count;
+        st->qt = (Quadtree){NULL, 0, 0, tt->pool};
+        return;
+    }
+
+    tt->splits[tt->n_splits++] = node;
+    subdivide(node, &tt->qt);
+
+    int counts[4] = {0, 0, 0, 0};
+    for(int i=0;i<count;i++) {
+        counts[quadrant_of(node, &bodies[i]->pos)]++;
+    }
+    int offsets[4];
+    int fill[4];
+    offsets[0] = 0;
+    for(int q=1;q<4;q++) {
+        offsets[q] = offsets[q-1]+counts[q-1];
+    }
+    memcpy(fill, offsets, sizeof(fill));
+    for(int i=0;i<count;i++) {
+        scratch[fill[quadrant_of(node, &bodies[i]->pos)]++] = bodies[i];
+    }
+    memcpy(bodies, scratch, sizeof(Body*)*count);
+
+    for(int q=0;q<4;q++) {
+        split_top(node->children[q], bodies+offsets[q], counts[q], depth+1, cutoff, scratch, tt);
+    }
+}
+
+static void build_subtree(void* arg) {
+    Subtree* st = (Subtree*)arg;
+    if(st->count>1) {
+        claim_nodes(&st->qt, 8*st->count);
+    }
+    for(int i=0;i<st->count;i++) {
+        insert_body(st->bodies[i], st->root, &st->qt);
+    }
+}
+
 // barnes-hut
-void construct_tree(Body* bodies, Node* root, int* N, Quadtree* qt) {
-    
-    (*qt).nodes = (Node*)malloc(sizeof(Node)*(8*(*N))); // 8 times N should be a safe limit
-    (*qt).index = 0;
-    (*qt).size = 8*(*N);
+void construct_tree(Body* bodies, Node* root, int* N, TopTree* tt, Scheduler* sched) {
 
     // init root of quadtree
     root->center = (Vec2){0.0,0.0};
@@ -201,12 +332,63 @@ void construct_tree(Body* bodies, Node* root, int* N, Quadtree* qt) {
     for(int i=0;i<4;i++){ root->children[i]=NULL; }
     root->center_of_mass = (Vec2){0.0, 0.0};
 
-    // loop through all bodies
-    for(int i=0;i<(*N);i++){
-        insert_body(&bodies[i], root, qt);
+    int cutoff = MAX(MIN_SUBTREE_BODIES, (*N)/(sched_threads(sched)*SUBTREES_PER_THREAD));
+    int top_size = 4*MAX_SPLIT_DEPTH*((*N)/cutoff+1);
+    int max_subtrees = top_size+1;
+
+    // 8 times N should be a safe limit below the top levels, plus one refill block per subtree
+    tt->pool = (NodePool*)malloc(sizeof(NodePool));
+    tt->pool->size = top_size+8*(*N)+max_subtrees*NODE_BLOCK;
+    tt->pool->nodes = (Node*)malloc(sizeof(Node)*tt->pool->size);
+    atomic_init(&tt->pool->used, top_size); // top levels sit at the front of the pool
+    tt->qt = (Quadtree){tt->pool->nodes, 0, top_size, NULL};
+
+    tt->order = (Body**)malloc(sizeof(Body*)*(*N));
+    tt->subtrees = (Subtree*)malloc(sizeof(Subtree)*max_subtrees);
+    tt->n_subtrees = 0;
+    tt->splits = (Node**)malloc(sizeof(Node*)*(top_size/4));
+    tt->n_splits = 0;
+
+    for(int i=0;i<(*N);i++) {
+        tt->order[i] = &bodies[i];
     }
+    Body** scratch = (Body**)malloc(sizeof(Body*)*(*N));
+    split_top(root, tt->order, *N, 0, cutoff, scratch, tt);
+    free(scratch);
+
+    // loop through all subtrees
+    for(int i=0;i<tt->n_subtrees;i++) {
+        sched_spawn(sched, build_subtree, &tt->subtrees[i]);
+    }
+    sched_wait(sched);
 };
 
+void free_tree(TopTree* tt) {
+    free(tt->pool->nodes);
+    free(tt->pool);
+    free(tt->order);
+    free(tt->subtrees);
+    free(tt->splits);
+}
+
+static void combine_children(Node* root) {
+    root->mass = 0.0;
+    Vec2 weighted_sum = {0.0, 0.0};
+
+    for(int i=0;i<4;i++) {
+        if (root->children[i]) {
+            root->mass += root->children[i]->mass;
+            weighted_sum.x+=root->children[i]->center_of_mass.x*root->children[i]->mass;
+            weighted_sum.y+=root->children[i]->center_of_mass.y*root->children[i]->mass;
+        }
+    }
+
+    if (root->mass > 0.0) {
+        root->center_of_mass.x = weighted_sum.x / root->mass;
+        root->center_of_mass.y = weighted_sum.y / root->mass;
+    }
+}
+
 // marked
 void update_masses(Node* root) {
     if (root->obj!=NULL && root->children[0]==NULL) {
@@ -214,26 +396,34 @@ void update_masses(Node* root) {
         root->center_of_mass = root->obj->pos;
         return;
     }
-    root->mass = 0.0;
-    Vec2 weighted_sum = {0.0, 0.0};
 
     for(int i=0;i<4;i++) {
         if (root->children[i]) {
             update_masses(root->children[i]);
-            root->mass += root->children[i]->mass;
-            weighted_sum.x+=root->children[i]->center_of_mass.x*root->children[i]->mass;
-            weighted_sum.x+=root->children[i]->center_of_mass.y*root->children[i]->mass;
         }
     }
+    combine_children(root);
+}
 
-    if (root->mass > 0.0) {
-        root->center_of_mass.x = weighted_sum.x / root->mass;
-        root->center_of_mass.y = weighted_sum.y / root->mass;
+static void mass_subtree(void* arg) {
+    update_masses(((Subtree*)arg)->root);
+}
+
+void update_tree_masses(TopTree* tt, Scheduler* sched) {
+    for(int i=0;i<tt->n_subtrees;i++) {
+        sched_spawn(sched, mass_subtree, &tt->subtrees[i]);
+    }
+    sched_wait(sched);
+
+    // reverse pre-order visits children before their parent
+    for(int i=tt->n_splits-1;i>=0;i--) {
+        combine_children(tt->splits[i]);
     }
 }
 
-void force_calc(Node* root, Body* body, Vec2* acc) {
+int force_calc(Node* root, Body* body, Vec2* acc) {
     double force = 0.0;
+    int visited = 1;
     if (root->obj!=NULL && root->children[0]==NULL && root->obj!=body) {
         Vec2 d_ = (Vec2){root->center_of_mass.x-body->pos.x, root->center_of_mass.y-body->pos.y};
         double d = sqrt(d_.x*d_.x+d_.y*d_.y);
@@ -259,9 +449,10 @@ void force_calc(Node* root, Body* body, Vec2* acc) {
         } else {
             for(int i=0;i<4;i++) {
                 if(root->children[i]) {
-                    force_calc(root->children[i], body, acc);
+                    visited += force_calc(root->children[i], body, acc);
                 }
             }
         }
     }
+    return visited;
 }
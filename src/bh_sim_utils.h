@@ -1,6 +1,8 @@
 #ifndef BH_SIM_UTILS_H
 #define BH_SIM_UTILS_H
 
+#include "bh_sched.h"
+
 #define MAX(a, b) ((a)>(b)?(a):(b))         // return highest value
 #define MIN(a, b) ((a)<(b)?(a):(b))         // return lowest value
 #define CLAMP(a, b, c) (MIN(MAX(a,b),c))    // clamp a between b min and c max limits
@@ -40,12 +42,33 @@ struct Node {
     Vec2 center_of_mass;
 };
 
+typedef struct NodePool NodePool; // shared node storage, handed out in blocks to parallel subtree builds
+
 typedef struct {
     Node* nodes;
     int index; // of last node inserted
     int size;
+    NodePool* pool; // refills nodes when full, NULL for a fixed buffer
 } Quadtree;
 
+typedef struct {
+    Node* root;     // created by the top level split
+    Body** bodies;  // bodies inside root
+    int count;
+    Quadtree qt;    // private view of the node pool
+} Subtree;
+
+// top levels are split on one thread, the subtrees below them are independent tasks
+typedef struct {
+    NodePool* pool;
+    Quadtree qt;        // top level nodes
+    Body** order;       // bodies grouped by subtree
+    Subtree* subtrees;
+    int n_subtrees;
+    Node** splits;      // top level nodes that were split, pre-order
+    int n_splits;
+} TopTree;
+
 // sim core
 #ifdef __cplusplus
 extern "C" {
@@ -60,10 +83,13 @@ extern "C" {
     void runge_kutta_4(Body* obj, const Vec2* acc, const double dt);    // not implemented yet
     void leapfrog(Body* obj, const Vec2* acc, const double dt);         // not implemented yet
 
-    void barnes_hut_update(Body* bodies, Node* root, int* N, double dt);
-    void construct_tree(Body* bodies, Node* root, int* N, Quadtree* qt);
-    void update_masses(Node* root);
-    void force_calc(Node* root, Body* body, Vec2* acc);
+    // cost holds every body's force walk length of the previous step, used to size the force tasks
+    void barnes_hut_update(Body* bodies, Node* root, int* N, double dt, Scheduler* sched, int* cost);
+    void construct_tree(Body* bodies, Node* root, int* N, TopTree* tt, Scheduler* sched);
+    void free_tree(TopTree* tt);
+    void update_masses(Node* root);                     // single subtree, recursive
+    void update_tree_masses(TopTree* tt, Scheduler* sched);
+    int force_calc(Node* root, Body* body, Vec2* acc);  // returns nodes visited
 #ifdef __cplusplus
 }
 #endif